@@ -7,7 +7,7 @@
 # to work on Purism Librem 13 v1 laptops, builds the final coreboot flash image,
 # and flashes it.
 
-# Dependencies : curl dmidecode flashrom sharutils
+# Dependencies : curl diffutils dmidecode flashrom gawk|mawk sharutils
 
 ARGV=$1
 CACHE_HOME="${XDG_CACHE_HOME}"
@@ -59,6 +59,12 @@ COREBOOT_BASE_URL='http://kakaroto.homelinux.net/purism/coreboot_base_bios.rom.b
 COREBOOT_BASE_SHA1='e1673cdfbeb9b44801781b5aa43ea869b2496ddc'
 
 COREBOOT_FINAL_IMAGE='coreboot.rom'
+# Smallest erase unit (4KB sector) of the MX25L6406E flash chip
+FLASH_ERASE_BLOCK_SIZE='4096'
+# Unchanged erase blocks between two changed ones that get rewritten to save a layout entry
+FLASH_MERGE_GAP_BLOCKS='16'
+# flashrom (MAX_ROMLAYOUT) refuses layouts with more entries than this
+FLASHROM_MAX_LAYOUT_ENTRIES='32'
 
 log_file () {
     local msg=$1
@@ -137,6 +143,8 @@ check_dependencies () {
     check_dependency "bunzip2      " bunzip2
     check_dependency "parted       " parted
     check_dependency "dd           " dd
+    check_dependency "cmp          " cmp
+    check_dependency "awk          " awk
     check_dependency "debugfs      " debugfs
     check_dependency "uudecode     " uudecode
     log ""
@@ -637,6 +645,130 @@ EOF
 
 }
 
+plan_flash_regions() {
+    local layout="${TEMPDIR}/flashrom_layout.txt"
+    local regions=''
+    local range=''
+    local name=''
+    local summary=''
+    local status=''
+    local orig_size=0
+    local image_size=0
+
+    # Defaults to writing the whole chip if we can't figure out what changed
+    FLASH_NEEDED=1
+    FLASHROM_LAYOUT_ARGS=""
+
+    log 'Comparing the new coreboot image with your current BIOS...'
+    orig_size=$(stat -c%s "${ORIG_FILENAME}" 2>/dev/null || echo -ne "0")
+    image_size=$(stat -c%s "${COREBOOT_FINAL_IMAGE}")
+    if [ "${orig_size}" != "${image_size}" ]; then
+        log "The BIOS backup does not match the size of the new image, the whole flash will be written"
+        log ""
+        return
+    fi
+    if ! ${IFDTOOL} -f ${TEMPDIR}/ifdtool_layout.txt ${COREBOOT_FINAL_IMAGE} > ${TEMPDIR}/ifdtool_layout.log 2>&1 ; then
+        log "Unable to read the flash regions of the new image, the whole flash will be written"
+        log ""
+        return
+    fi
+    # Convert the ifdtool layout into 'start:end:name' with decimal offsets for awk
+    while read range name; do
+        regions="${regions} $((16#${range%%:*})):$((16#${range##*:})):${name}"
+    done < ${TEMPDIR}/ifdtool_layout.txt
+
+    # cmp -l lists every differing byte with its 1-based offset, in increasing order.
+    # Group them by erase block and merge changed blocks separated by small gaps into
+    # layout entries, without letting an entry cross a flash region boundary.
+    # The exit status of cmp and awk is appended to the output since a cmp failure
+    # would otherwise look exactly like two identical images.
+    summary=$(cmp -l ${ORIG_FILENAME} ${COREBOOT_FINAL_IMAGE} 2> ${TEMPDIR}/cmp.log | \
+        awk -v bs=${FLASH_ERASE_BLOCK_SIZE} -v gap=${FLASH_MERGE_GAP_BLOCKS} \
+            -v regions="${regions}" -v layout="${layout}" '
+        function region_of(offset,    i) {
+            for (i = 1; i <= nregions; i++)
+                if (offset >= rstart[i] && offset <= rend[i])
+                    return rname[i]
+            return "unmapped"
+        }
+        function flush_entry() {
+            if (entry_name == "")
+                return
+            printf("%08x:%08x %s_%d\n", entry_start, entry_end, entry_name, entries[entry_name]++) > layout
+            nentries++
+            write_bytes += entry_end - entry_start + 1
+            region_write[entry_name] += entry_end - entry_start + 1
+        }
+        BEGIN {
+            nregions = split(regions, list, " ")
+            for (i = 1; i <= nregions; i++) {
+                split(list[i], f, ":")
+                rstart[i] = f[1] + 0
+                rend[i] = f[2] + 0
+                rname[i] = f[3]
+                blocks[f[3]] = 0
+            }
+            last = -1
+            printf("") > layout
+        }
+        {
+            diff_bytes++
+            block = int(($1 - 1) / bs)
+            if (block == last)
+                next
+            start = block * bs
+            name = region_of(start)
+            if (name == entry_name && block - last - 1 <= gap) {
+                entry_end = start + bs - 1
+            } else {
+                flush_entry()
+                entry_name = name
+                entry_start = start
+                entry_end = start + bs - 1
+            }
+            blocks[name]++
+            total++
+            last = block
+        }
+        END {
+            flush_entry()
+            for (name in blocks)
+                printf("region %s %d %d\n", name, blocks[name], region_write[name])
+            printf("total %d %d %d %d\n", total, diff_bytes, nentries, write_bytes)
+        }'; echo "status ${PIPESTATUS[0]} ${PIPESTATUS[1]}")
+    echo "${summary}" > ${TEMPDIR}/flash_plan.log
+    status=$(echo "${summary}" | grep '^status ' | cut -d' ' -f 2-)
+    # cmp returns 0 for identical files, 1 if they differ and 2 on errors
+    if [ "${status}" != "0 0" -a "${status}" != "1 0" ]; then
+        log "Unable to compare the BIOS backup with the new image, the whole flash will be written"
+        log ""
+        return
+    fi
+
+    local total_blocks=$(echo "${summary}" | grep '^total ' | cut -d' ' -f 2)
+    local diff_bytes=$(echo "${summary}" | grep '^total ' | cut -d' ' -f 3)
+    local entries=$(echo "${summary}" | grep '^total ' | cut -d' ' -f 4)
+    local write_bytes=$(echo "${summary}" | grep '^total ' | cut -d' ' -f 5)
+    if [ "${status}" == "0 0" -a "${total_blocks}" == "0" ]; then
+        FLASH_NEEDED=0
+        log "Your BIOS backup is identical to the new image, the flash will only be verified"
+        log ""
+        return
+    fi
+    echo "${summary}" | grep '^region ' | sort | while read _ name count region_bytes; do
+        log "  ${name}: ${count} erase blocks differ, $((region_bytes / 1024))KB to erase and rewrite"
+    done
+    if [ "${entries}" -gt "${FLASHROM_MAX_LAYOUT_ENTRIES}" ]; then
+        log "The changes are spread over too many parts of the flash, the whole flash will be written"
+        log ""
+        return
+    fi
+    log "Expected volume: $((write_bytes / 1024))KB to erase and rewrite out of $((image_size / 1024))KB (${diff_bytes} bytes differ)"
+    log "Unchanged erase blocks lying between nearby changes are rewritten as well."
+    log ""
+    FLASHROM_LAYOUT_ARGS="-l ${layout}$(awk '{ printf(" -i %s", $2) }' ${layout})"
+}
+
 check_battery() {
     local capacity=$(cat /sys/class/power_supply/BAT*/capacity 2>/dev/null || echo -ne "0")
     local online=$(cat /sys/class/power_supply/AC/online 2>/dev/null || cat /sys/class/power_supply/ADP*/online 2>/dev/null || echo -ne "0")
@@ -721,9 +853,50 @@ flashrom_progress() {
     echo ""
 }
 
+flashrom_write() {
+    local layout_args=$1
+
+    ${FLASHROM} -V ${FLASHROM_PROGRAMMER} ${FLASHROM_ARGS} ${layout_args} -w ${COREBOOT_FINAL_IMAGE} 2>&1 | tee -a ${TEMPDIR}/flashrom_write.log | flashrom_progress
+    if [ ${PIPESTATUS[0]} -ne 0 ]; then
+        log ''
+        log ''
+        log ''
+        tail -n 20 ${TEMPDIR}/flashrom_write.log
+        log ''
+        log ''
+        log ''
+        log 'ERROR: It appears that flashing your BIOS has failed. '
+        log 'Do NOT power off or restart your computer. Try running this script again until'
+        log 'it succeeds, or try to flash back the BIOS using your original BIOS backup file'
+        log "which is available in the file '${CACHE_DIR}/${ORIG_FILENAME}' "
+        echo "Log files are available in '${TEMPDIR}'"
+        exit 1
+    fi
+}
+
+# A partial write only verifies the regions it wrote, and the rest of the flash
+# may have changed since the backup was made, so always compare the whole chip.
+flashrom_verify() {
+    log 'Verifying the whole flash contents against the coreboot image. Please wait...'
+    ${FLASHROM} -V ${FLASHROM_PROGRAMMER} ${FLASHROM_ARGS} -v ${COREBOOT_FINAL_IMAGE} >> ${TEMPDIR}/flashrom_verify.log 2>&1
+}
 
 flash_coreboot() {
     local answer='no'
+
+    if [ "${IS_LIBREM13V1}" == "1" -a "${FLASH_NEEDED}" == "0" ]; then
+        if flashrom_verify ; then
+            log ''
+            log 'Your flash already contains this exact coreboot image, nothing was flashed.'
+            log 'There is no need to reboot your computer.'
+            log ''
+            echo "Log files are available in '${TEMPDIR}'"
+            exit 0
+        fi
+        log 'Your flash contents changed since the backup was made, the whole flash will be written'
+        FLASH_NEEDED=1
+        FLASHROM_LAYOUT_ARGS=""
+    fi
     log ''
     log ''
     log 'Your coreboot image is now ready. We can now flash your BIOS with coreboot.'
@@ -739,21 +912,10 @@ flash_coreboot() {
     done
     if [ "${IS_LIBREM13V1}" == "1" ]; then
         log '**** Flashing coreboot to your BIOS Flash ****'
-        ${FLASHROM} -V ${FLASHROM_PROGRAMMER} ${FLASHROM_ARGS} -w ${COREBOOT_FINAL_IMAGE} 2>&1 | tee ${TEMPDIR}/flashrom_write.log | flashrom_progress
-        if [ ${PIPESTATUS[0]} -ne 0 ]; then
-            log ''
-            log ''
-            log ''
-            tail -n 20 ${TEMPDIR}/flashrom_write.log
-            log ''
-            log ''
-            log ''
-            log 'ERROR: It appears that flashing your BIOS has failed. '
-            log 'Do NOT power off or restart your computer. Try running this script again until'
-            log 'it succeeds, or try to flash back the BIOS using your original BIOS backup file'
-            log "which is available in the file '${CACHE_DIR}/${ORIG_FILENAME}' "
-            echo "Log files are available in '${TEMPDIR}'"
-            exit 1
+        flashrom_write "${FLASHROM_LAYOUT_ARGS}"
+        if [ "${FLASHROM_LAYOUT_ARGS}" != "" ] && ! flashrom_verify ; then
+            log 'The flash does not fully match the coreboot image, the whole flash will now be written'
+            flashrom_write ""
         fi
     fi
     
@@ -786,6 +948,7 @@ get_librem13v1_coreboot
 build_flash_image
 build_cbfs_image
 apply_config_options
+plan_flash_regions
 check_battery
 flash_coreboot
 reboot